@@ -0,0 +1,158 @@
+/*-
+ * Copyright (c) 2017, Alexandre P. Francisco <aplf@ist.utl.pt>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Sampled top levels of the suffix array search. A plain binary search over
+ * the suffix array takes two dependent cache misses per level, one in the
+ * suffix array and another in the text. The samples are small enough to stay
+ * cache resident and hold the first alleles of each sampled suffix, thus
+ * most levels are resolved without touching either.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eyutils.h"
+
+/* Sections are aligned to cache lines. */
+#define EY_ALIGN 64
+
+static int
+ey_fill(ey_index_t *ey, int32_t *s, int32_t *sa, int r, int i)
+{
+    int t;
+
+    if (i > ey->nn)
+        return r;
+
+    r = ey_fill(ey, s, sa, r, 2*i);
+
+    ey->node[i].pos = sa[r*ey->step];
+    ey->node[i].rank = r;
+    for (t = 0; t < EY_KEY; t++)
+        ey->node[i].key[t] = ey->node[i].pos + t <= ey->n ?
+            s[ey->node[i].pos + t] : -1;
+
+    return ey_fill(ey, s, sa, r + 1, 2*i + 1);
+}
+
+/* Compares p with the sampled suffix at node i, as array_cmp does, looking
+ * at the text only when the inlined alleles are not enough. */
+static inline int
+ey_cmp(ey_index_t *ey, int32_t *s, int32_t *p, int m, int i)
+{
+    ey_node_t *v = ey->node + i;
+    int t;
+
+    for (t = 0; t < EY_KEY && t < m; t++)
+        if (p[t] != v->key[t])
+            return p[t] - v->key[t];
+
+    for (s += v->pos; t < m && p[t] == s[t]; t++);
+    if (t >= m)
+        return 0;
+    return p[t] - s[t];
+}
+
+int
+ey_build(ey_index_t *ey, int32_t *s, int32_t *sa, int n)
+{
+    ey->n = n;
+    ey->step = (n + EY_MAX_NODES - 1)/EY_MAX_NODES;
+    if (ey->step < 1)
+        ey->step = 1;
+    ey->nn = (n + ey->step - 1)/ey->step;
+    ey->node = malloc(sizeof(ey_node_t)*(ey->nn + 1));
+    if (ey->node == NULL)
+        return -1;
+
+    memset(ey->node, 0, sizeof(ey_node_t));
+    ey_fill(ey, s, sa, 0, 1);
+
+    return 0;
+}
+
+int
+ey_write(ey_index_t *ey, FILE *fptr)
+{
+    int32_t pad = 0;
+    int wn;
+
+    wn = fwrite(&ey->n, sizeof(int32_t), 1, fptr);
+    wn += fwrite(&ey->step, sizeof(int32_t), 1, fptr);
+    wn += fwrite(&ey->nn, sizeof(int32_t), 1, fptr);
+    if (wn != 3)
+        return -1;
+
+    while (ftell(fptr) % EY_ALIGN != 0)
+        if (fwrite(&pad, sizeof(int32_t), 1, fptr) != 1)
+            return -1;
+
+    if (fwrite(ey->node, sizeof(ey_node_t), ey->nn + 1, fptr) !=
+        (size_t)ey->nn + 1)
+        return -1;
+
+    return 0;
+}
+
+int32_t *
+ey_map(ey_index_t *ey, int32_t *p)
+{
+    ey->n = p[0];
+    ey->step = p[1];
+    ey->nn = p[2];
+
+    /* The index is mapped at a page boundary. */
+    p += 3;
+    while ((uintptr_t)p % EY_ALIGN != 0)
+        p++;
+    ey->node = (ey_node_t *)p;
+
+    return (int32_t *)(ey->node + ey->nn + 1);
+}
+
+void
+ey_free(ey_index_t *ey)
+{
+    free(ey->node);
+    ey->node = NULL;
+}
+
+/* Narrows the suffix array range [lo, hi) for the first suffix not smaller
+ * than the pattern p of length m, or greater if strict is set, as found by
+ * sa_search_low and sa_search_high. */
+void
+ey_range(ey_index_t *ey, int32_t *s, int32_t *p, int m, int strict, int *lo,
+    int *hi)
+{
+    int i = 1, r, c;
+
+    while (i <= ey->nn) {
+        /* Grandchildren take two cache lines. */
+        __builtin_prefetch(ey->node + 4*i);
+        __builtin_prefetch(ey->node + 4*i + 2);
+        c = ey_cmp(ey, s, p, m, i);
+        i = 2*i + (strict ? c >= 0 : c > 0);
+    }
+    /* Undo the right turns after the last left turn. */
+    i >>= __builtin_ffs(~i);
+
+    r = i ? ey->node[i].rank : ey->nn;
+    *lo = r ? (r - 1)*ey->step + 1 : 0;
+    *hi = r*ey->step < ey->n ? r*ey->step : ey->n;
+}
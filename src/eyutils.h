@@ -0,0 +1,52 @@
+/*-
+ * Copyright (c) 2017, Alexandre P. Francisco <aplf@ist.utl.pt>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef EYUTILS_H
+#define EYUTILS_H
+
+/* Number of alleles inlined in each node. */
+#define EY_KEY 6
+/* Largest number of nodes, 256KB, so that the tree fits in L2. */
+#define EY_MAX_NODES (1 << 13)
+
+/* A sampled suffix: its first alleles, its position in the text and its
+ * rank among the samples. Nodes take 32 bytes, two per cache line. Suffixes
+ * often start with runs of the same few alleles, thus deep samples need
+ * several inlined alleles to be told apart without reading the text. */
+typedef struct {
+    int32_t key[EY_KEY];
+    int32_t pos, rank;
+} ey_node_t;
+
+/* Every step-th suffix of the suffix array, sa[0], sa[step], ..., stored in
+ * Eytzinger order, i.e., as an implicit binary search tree where node i has
+ * children 2i and 2i+1. Node 0 is unused.
+ */
+typedef struct {
+    int32_t n, step, nn;
+    ey_node_t *node;
+} ey_index_t;
+
+int ey_build(ey_index_t *ey, int32_t *s, int32_t *sa, int n);
+int ey_write(ey_index_t *ey, FILE *fptr);
+int32_t *ey_map(ey_index_t *ey, int32_t *p);
+void ey_free(ey_index_t *ey);
+
+void ey_range(ey_index_t *ey, int32_t *s, int32_t *p, int m, int strict,
+    int *lo, int *hi);
+
+#endif
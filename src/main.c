@@ -38,6 +38,7 @@
 
 #include "main.h"
 #include "sautils.h"
+#include "pkutils.h"
 
 #define cpuTime() (clock()*1e-6)
 
@@ -45,14 +46,22 @@ static int32_t *lidx;
 static int32_t *profiles;
 static int32_t *sa;
 static int32_t n, n_al, n_ST;
+static pk_index_t pk;
+static sk_index_t sk;
+static ey_index_t ey;
+static sa_index_t ix;
 
 int
 main(int argc, char * argv[])
 {
-    char iname[132] = { 0 }, lname[132] = { 0 }, mode = 'q', *lblock;
+    char iname[132] = { 0 }, lname[132] = { 0 }, mode = 'q', *lblock,
+        **qid = NULL, *loci = NULL;
     int32_t opt = -1, k = -1, sigma = -1, *isa = NULL, wn = 0, fd, lfd, *mblock,
-        *q, nr, i;
-    int32_pair_t *r;
+        *q = NULL, nr, i, j, flags = 0, *sec, plain = 0, locus = 0, *lsa,
+        many = 0, nq, mq = 0, *off = NULL;
+    int32_pair_t *r, *rb = NULL, *rq;
+    double recall = 1;
+    uint8_t *mask = NULL;
     struct stat sb;
     FILE *fptr = NULL, *lptr = NULL;
 
@@ -60,13 +69,21 @@ main(int argc, char * argv[])
      *
      *  i - index name
      *  b - build index
+     *  l - build the locus partitioned suffix array instead
      *  q - query index
+     *  n - query index for the closest STs
+     *  a - approximate query, discarding candidates through sketches
+     *  x - query using only the suffix array
+     *  m - answer many queries, one per line, sharing searches
+     *  s - query only a subset of loci
      *
      * Option 'i' requires an argument, a string. Option 'q' requires also an
-     * argument, the maximum error allowed. Both the query and profiles to index
-     * should be provided through stdin.
+     * argument, the maximum error allowed. Option 'a' requires the target
+     * recall, a number in (0,1]. Option 's' requires a list of loci, e.g.,
+     * 1-7,10 for the first seven and the tenth. Both the query and profiles
+     * to index should be provided through stdin.
      */
-    while ((opt = getopt(argc, argv, "i:q:b")) != -1) {
+    while ((opt = getopt(argc, argv, "i:q:blna:xms:")) != -1) {
         switch (opt) {
         case 'i':
             strncpy(iname, optarg, 127);
@@ -75,17 +92,35 @@ main(int argc, char * argv[])
         case 'b':
             mode = 'b'; 
             break;
+        case 'l':
+            locus = 1;
+            break;
         case 'q':
             mode = 'q';
             k = atoi(optarg);
             break;
+        case 'n':
+            mode = 'n';
+            break;
+        case 'a':
+            recall = atof(optarg);
+            break;
+        case 'x':
+            plain = 1;
+            break;
+        case 'm':
+            many = 1;
+            break;
+        case 's':
+            loci = optarg;
+            break;
         default: /* 'h' and invalid options.  */
             usage(argv[0]);
             exit(EXIT_FAILURE);
         }
     }
             
-    if (optind > argc || iname[0] == 0) {
+    if (optind > argc || iname[0] == 0 || recall <= 0 || recall > 1) {
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -93,7 +128,7 @@ main(int argc, char * argv[])
     strcat(iname, ".idx");
     strcat(lname, ".ids");
 
-    if (mode == 'q') {
+    if (mode == 'q' || mode == 'n') {
         fd = open(iname, O_RDONLY);
         fstat(fd, &sb);
         mblock = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
@@ -109,6 +144,40 @@ main(int argc, char * argv[])
         sa = profiles + (n + 1);
         lidx = sa + (n + 1);
 
+        /* Optional sections, absent in older indexes. */
+        sec = lidx + n_ST;
+        if ((char *)sec < (char *)mblock + sb.st_size)
+            flags = *sec++;
+        if (flags & IDX_PACKED)
+            sec = pk_map(&pk, sec);
+        if (flags & IDX_SKETCH) {
+            sec = sk_map(&sk, sec);
+            sk.recall = recall;
+        }
+        if (flags & IDX_SEARCH)
+            sec = ey_map(&ey, sec);
+        if (plain)
+            flags &= IDX_LOCUS;
+
+        ix.s = profiles;
+        ix.sa = flags & IDX_LOCUS ? NULL : sa;
+        ix.lsa = flags & IDX_LOCUS ? sa : NULL;
+        ix.d = n_ST;
+        ix.m = n_al;
+        ix.sk = flags & IDX_SKETCH ? &sk : NULL;
+        ix.ey = flags & IDX_SEARCH ? &ey : NULL;
+
+        /* Sketches bound distances over all loci, not on a subset. */
+        if (loci != NULL) {
+            mask = calloc(n_al, sizeof(uint8_t));
+            if (read_mask(loci, mask, n_al) <= 0) {
+                fprintf(stderr, "ERROR while parsing loci, giving up...\n");
+                return EXIT_FAILURE;
+            }
+            ix.mask = pk.mask = mask;
+            ix.sk = NULL;
+        }
+
         lfd = open(lname, O_RDONLY);
         fstat(lfd, &sb);
         lblock = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, lfd, 0);
@@ -117,23 +186,63 @@ main(int argc, char * argv[])
             return EXIT_FAILURE;
         }
 
-        /* Read query */
-        q = malloc(sizeof(int32_t)*(n_al + 1));
-        wn = read_query(stdin, q, n_al);
-        if (wn != n_al) {
-            fprintf(stderr, "ERROR while loading query, giving up...\n");
-            return EXIT_FAILURE;
+        /* Read query, or all of them when answering many */
+        for (nq = 0; nq == 0 || many; nq++) {
+            if (nq >= mq) {
+                mq = mq ? mq << 1 : 16;
+                q = realloc(q, sizeof(int32_t)*mq*(n_al + 1));
+                qid = realloc(qid, sizeof(char *)*mq);
+            }
+            wn = read_query(stdin, qid + nq, q + nq*(n_al + 1), n_al);
+            /* Skip blank lines, stop only at the end of input. */
+            if (wn < 0 && many && !feof(stdin)) {
+                nq--;
+                continue;
+            }
+            if (wn < 0 && nq > 0)
+                break;
+            if (wn != n_al) {
+                fprintf(stderr, "ERROR while loading query, giving up...\n");
+                return EXIT_FAILURE;
+            }
         }
 
+        /* Many threshold queries share their searches. */
         r = malloc(sizeof(int32_pair_t)*n_ST);
-        nr = solve_query(profiles, sa, q, n_ST, n_al, k+1, r);
-        qsort(r, nr, sizeof(int32_pair_t), int32_pair_cmp);
+        if (many && mode == 'q' && !(flags & IDX_PACKED)) {
+            off = malloc(sizeof(int32_t)*(nq + 1));
+            solve_batch(&ix, q, nq, k+1, &rb, off);
+        }
 
-        for (i = 0; i < nr; i++)
-            printf("%s\t%d\n", lblock + lidx[r[i].id], r[i].n);
+        for (j = 0; j < nq; j++) {
+            rq = r;
+            if (rb != NULL) {
+                rq = rb + off[j];
+                nr = off[j+1] - off[j];
+            } else if (flags & IDX_PACKED)
+                nr = mode == 'n' ? pk_solve_nearest(&pk, q + j*(n_al + 1), r) :
+                    pk_solve_query(&pk, q + j*(n_al + 1), k+1, r);
+            else
+                nr = mode == 'n' ? solve_nearest(&ix, q + j*(n_al + 1), r) :
+                    solve_query(&ix, q + j*(n_al + 1), k+1, r);
+            qsort(rq, nr, sizeof(int32_pair_t), int32_pair_cmp);
+
+            for (i = 0; i < nr; i++)
+                if (many)
+                    printf("%s\t%s\t%d\n", qid[j], lblock + lidx[rq[i].id],
+                        rq[i].n);
+                else
+                    printf("%s\t%d\n", lblock + lidx[rq[i].id], rq[i].n);
+            free(qid[j]);
+        }
 
+        solve_free(&ix);
+        free(off);
+        free(rb);
         free(r);
+        free(qid);
         free(q);
+        free(mask);
         close(fd);
         close(lfd);
         return EXIT_SUCCESS;
@@ -164,6 +273,23 @@ main(int argc, char * argv[])
     /* We do not need the ISA! */
     free(isa);
 
+    /* Small schemes are also packed for full scans. */
+    if (pk_build(&pk, profiles, n_ST, n_al) == 0)
+        flags |= IDX_PACKED;
+    /* Large schemes get sketches for discarding candidates. */
+    if (sk_build(&sk, profiles, n_ST, n_al) == 0)
+        flags |= IDX_SKETCH;
+    /* The locus partitioned suffix array takes the place of the suffix array,
+     * otherwise sample its top levels. */
+    if (locus) {
+        lsa = calloc(n + 1, sizeof(int32_t));
+        sa_partition(sa, lsa, n_ST, n_al);
+        free(sa);
+        sa = lsa;
+        flags |= IDX_LOCUS;
+    } else if (ey_build(&ey, profiles, sa, n) == 0)
+        flags |= IDX_SEARCH;
+
     fprintf(stderr, "[%f] Writing index...\n", cpuTime());
     fptr = fopen(iname,"wb");
     if (fptr == NULL) {
@@ -175,13 +301,26 @@ main(int argc, char * argv[])
     wn += fwrite(profiles, sizeof(int32_t), (n + 1), fptr);
     wn += fwrite(sa, sizeof(int32_t), (n + 1), fptr);
     wn += fwrite(lidx, sizeof(int32_t), n_ST, fptr);
+    wn += fwrite(&flags, sizeof(flags), 1, fptr);
+    if ((flags & IDX_PACKED) && pk_write(&pk, fptr) != 0)
+        wn = -1;
+    if ((flags & IDX_SKETCH) && sk_write(&sk, fptr) != 0)
+        wn = -1;
+    if ((flags & IDX_SEARCH) && ey_write(&ey, fptr) != 0)
+        wn = -1;
     fclose(fptr);
 
+    if (flags & IDX_PACKED)
+        pk_free(&pk);
+    if (flags & IDX_SKETCH)
+        sk_free(&sk);
+    if (flags & IDX_SEARCH)
+        ey_free(&ey);
     free(lidx);
     free(profiles);
     free(sa);
 
-    if (wn != 2 + 2*(n+1) + n_ST) {
+    if (wn != 2 + 2*(n+1) + n_ST + 1) {
         fprintf(stderr,
             "An error occured while writing the index, exiting...\n");
         return EXIT_FAILURE;
@@ -192,7 +331,7 @@ main(int argc, char * argv[])
 }
 
 int
-read_query(FILE * fd, int32_t *q, int32_t l) {
+read_query(FILE * fd, char **id, int32_t *q, int32_t l) {
     char *buffer = NULL, *tok;
     int32_t bsize = 0, i;
 
@@ -200,11 +339,14 @@ read_query(FILE * fd, int32_t *q, int32_t l) {
 
     tok = strtok(buffer, "\t\n, ");
 
-    if (tok == NULL)
-            return -1;
+    if (tok == NULL) {
+        free(buffer);
+        return -1;
+    }
 
     /* Let us get the ST_id for this line. */
-    /* id = atoi(tok); unused */
+    *id = malloc(strlen(tok) + 1);
+    strcpy(*id, tok);
  
     for (i = 0; i < l && (tok = strtok(NULL, "\t\n, ")) != NULL; i++)
         q[i] = atoi(tok) + 1;
@@ -216,6 +358,28 @@ read_query(FILE * fd, int32_t *q, int32_t l) {
     return i;
 }
 
+int
+read_mask(char *list, uint8_t *w, int32_t l)
+{
+    char *tok, *end;
+    int32_t a, b, i, c = 0;
+
+    /* Comma separated loci or ranges of loci, numbered from 1. */
+    for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        a = b = strtol(tok, &end, 10);
+        if (*end == '-')
+            b = strtol(end + 1, &end, 10);
+        if (*end != '\0' || a < 1 || b < a || b > l)
+            return -1;
+        for (i = a - 1; i < b; i++) {
+            c += !w[i];
+            w[i] = 1;
+        }
+    }
+
+    return c;
+}
+
 int
 load_STs(FILE *fd, FILE *lfd)
 {
@@ -296,6 +460,11 @@ readline(FILE *fd, char **bf, int *bz)
 {
     int rt, c, i = 0;
 
+    if (*bz == 0) {
+        *bz = 1024;
+        *bf = realloc(*bf, sizeof(char)*(*bz + 1));
+    }
+
     while ((c = getc(fd)) != '\n' && c != EOF) {
         if (i >= *bz) {
             if (*bz != 0) *bz <<= 1;
@@ -337,7 +506,15 @@ Options:\n\
 ");
     fprintf(stderr, "  -i INAME   The name for the index (mandatory).\n");
     fprintf(stderr, "  -q K       List matches with at most K errors.\n");
+    fprintf(stderr, "  -n         List the closest matches.\n");
+    fprintf(stderr, "  -a R       Approximate queries through sketches, with\n"
+                    "             expected recall at least R.\n");
+    fprintf(stderr, "  -x         Query using only the suffix array.\n");
+    fprintf(stderr, "  -m         Answer many queries, one per line, listing\n"
+                    "             the query id first.\n");
+    fprintf(stderr, "  -s LOCI    Count errors only at LOCI, e.g., 1-7,10.\n");
     fprintf(stderr, "  -b         The index should be (re)built.\n");
+    fprintf(stderr, "  -l         Build a suffix array per locus.\n");
     fprintf(stderr, "\n");
 
 }
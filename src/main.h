@@ -17,9 +17,16 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+/* Optional index sections. */
+#define IDX_PACKED 0x1
+#define IDX_SKETCH 0x2
+#define IDX_SEARCH 0x4
+#define IDX_LOCUS  0x8
+
 int st_diff(int, int);
 
-int read_query(FILE * fd, int32_t *q, int32_t l);
+int read_query(FILE * fd, char **id, int32_t *q, int32_t l);
+int read_mask(char *list, uint8_t *w, int32_t l);
 int load_STs(FILE *, FILE *);
 int readline(FILE *fd, char **bf, int *bz);
 void usage();
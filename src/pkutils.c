@@ -0,0 +1,243 @@
+/*-
+ * Copyright (c) 2017, Alexandre P. Francisco <aplf@ist.utl.pt>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Packed engine for small schemes, e.g., classic 7-locus MLST. For these a
+ * full scan over all STs, counting equal alleles eight STs at a time, is
+ * faster than searching the suffix array and verifying candidates.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pkutils.h"
+
+/* Value used for query alleles that cannot be packed, it matches nothing. */
+#define PK_NONE 0
+
+/* Counts, for the 8 STs starting at c, how many of the M loci are equal to
+ * the query q, or excluded (all bits set in x), storing the counts in e.
+ * Returns nonzero if some count is at least t.
+ */
+#ifdef __SSE2__
+#define PK_DEFINE_BLOCK(M)                                                   \
+static inline int                                                           \
+pk_block_##M(uint16_t *c, int stride, uint16_t *q, uint16_t *x, int t,     \
+    uint16_t *e)                                                            \
+{                                                                           \
+    __m128i acc = _mm_setzero_si128();                                      \
+    int l;                                                                  \
+    for (l = 0; l < M; l++)                                                 \
+        acc = _mm_sub_epi16(acc, _mm_or_si128(_mm_cmpeq_epi16(              \
+            _mm_loadu_si128((__m128i *)(c + l*stride)),                     \
+            _mm_set1_epi16(q[l])), _mm_set1_epi16(x[l])));                  \
+    _mm_storeu_si128((__m128i *)e, acc);                                    \
+    return _mm_movemask_epi8(_mm_cmpgt_epi16(acc, _mm_set1_epi16(t - 1)));  \
+}
+#else
+#define PK_DEFINE_BLOCK(M)                                                   \
+static inline int                                                           \
+pk_block_##M(uint16_t *c, int stride, uint16_t *q, uint16_t *x, int t,     \
+    uint16_t *e)                                                            \
+{                                                                           \
+    int i, l, y = 0;                                                        \
+    for (i = 0; i < 8; i++)                                                 \
+        e[i] = 0;                                                           \
+    for (l = 0; l < M; l++)                                                 \
+        for (i = 0; i < 8; i++)                                             \
+            e[i] += (c[l*stride + i] == q[l]) | (x[l] & 1);                 \
+    for (i = 0; i < 8; i++)                                                 \
+        y |= e[i] >= t;                                                     \
+    return y;                                                               \
+}
+#endif
+
+/* Lists the STs with at least t equal alleles, i.e., at most M - t errors. */
+#define PK_DEFINE_SCAN(M)                                                    \
+static int                                                                  \
+pk_scan_##M(pk_index_t *pk, uint16_t *q, uint16_t *x, int t,               \
+    int32_pair_t *rv)                                                       \
+{                                                                           \
+    uint16_t e[8];                                                          \
+    int i, j, nr = 0;                                                       \
+    for (j = 0; j < pk->d; j += 8) {                                        \
+        if (!pk_block_##M(pk->col + j, pk->stride, q, x, t, e))             \
+            continue;                                                       \
+        for (i = 0; i < 8 && j + i < pk->d; i++)                            \
+            if (e[i] >= t) {                                                \
+                rv[nr].id = j + i;                                          \
+                rv[nr].n = M - e[i];                                        \
+                nr++;                                                       \
+            }                                                               \
+    }                                                                       \
+    return nr;                                                              \
+}
+
+/* Returns the largest number of equal alleles among all STs. */
+#define PK_DEFINE_BEST(M)                                                    \
+static int                                                                  \
+pk_best_##M(pk_index_t *pk, uint16_t *q, uint16_t *x)                       \
+{                                                                           \
+    uint16_t e[8];                                                          \
+    int i, j, t = 0;                                                        \
+    for (j = 0; j < pk->d; j += 8) {                                        \
+        if (!pk_block_##M(pk->col + j, pk->stride, q, x, t + 1, e))         \
+            continue;                                                       \
+        for (i = 0; i < 8 && j + i < pk->d; i++)                            \
+            if (e[i] > t)                                                   \
+                t = e[i];                                                   \
+    }                                                                       \
+    return t;                                                               \
+}
+
+#define PK_DEFINE(M)                                                         \
+    PK_DEFINE_BLOCK(M)                                                      \
+    PK_DEFINE_SCAN(M)                                                       \
+    PK_DEFINE_BEST(M)
+
+PK_DEFINE(8)
+PK_DEFINE(16)
+
+static int
+pk_scan(pk_index_t *pk, uint16_t *q, uint16_t *x, int t, int32_pair_t *rv)
+{
+    if (pk->m == 8)
+        return pk_scan_8(pk, q, x, t, rv);
+    return pk_scan_16(pk, q, x, t, rv);
+}
+
+static int
+pk_best(pk_index_t *pk, uint16_t *q, uint16_t *x)
+{
+    if (pk->m == 8)
+        return pk_best_8(pk, q, x);
+    return pk_best_16(pk, q, x);
+}
+
+/* Packs the query, padding loci beyond n_al with zeros as in the columns.
+ * Loci not in the mask are marked in x, they count as equal. */
+static void
+pk_query(pk_index_t *pk, int32_t *q, uint16_t *qq, uint16_t *x)
+{
+    int l;
+
+    memset(qq, 0, sizeof(uint16_t)*PK_MAX_LOCI);
+    memset(x, 0, sizeof(uint16_t)*PK_MAX_LOCI);
+    for (l = 0; l < pk->n_al; l++) {
+        qq[l] = (q[l] > 0 && q[l] <= UINT16_MAX) ? q[l] : PK_NONE;
+        if (pk->mask != NULL && !pk->mask[l])
+            x[l] = UINT16_MAX;
+    }
+}
+
+int
+pk_build(pk_index_t *pk, int32_t *s, int d, int m)
+{
+    int j, l;
+
+    if (m > PK_MAX_LOCI)
+        return -1;
+
+    for (j = 0; j < d; j++)
+        for (l = 0; l < m; l++)
+            if (s[j*(m+1) + l] <= PK_NONE || s[j*(m+1) + l] > UINT16_MAX)
+                return -1;
+
+    pk->d = d;
+    pk->n_al = m;
+    pk->m = m <= 8 ? 8 : 16;
+    pk->stride = (d + 7) & ~7;
+    pk->col = calloc((size_t)pk->m*pk->stride, sizeof(uint16_t));
+    if (pk->col == NULL)
+        return -1;
+
+    for (j = 0; j < d; j++)
+        for (l = 0; l < m; l++)
+            pk->col[l*pk->stride + j] = s[j*(m+1) + l];
+
+    return 0;
+}
+
+int
+pk_write(pk_index_t *pk, FILE *fptr)
+{
+    int wn;
+    size_t sz = (size_t)pk->m*pk->stride;
+
+    wn = fwrite(&pk->d, sizeof(int32_t), 1, fptr);
+    wn += fwrite(&pk->n_al, sizeof(int32_t), 1, fptr);
+    wn += fwrite(&pk->m, sizeof(int32_t), 1, fptr);
+    wn += fwrite(&pk->stride, sizeof(int32_t), 1, fptr);
+    if (wn != 4 || fwrite(pk->col, sizeof(uint16_t), sz, fptr) != sz)
+        return -1;
+
+    return 0;
+}
+
+int32_t *
+pk_map(pk_index_t *pk, int32_t *p)
+{
+    pk->d = p[0];
+    pk->n_al = p[1];
+    pk->m = p[2];
+    pk->stride = p[3];
+    pk->col = (uint16_t *)(p + 4);
+    pk->mask = NULL;
+
+    /* The stride is a multiple of 8, thus columns fill whole words. */
+    return p + 4 + pk->m*pk->stride/2;
+}
+
+void
+pk_free(pk_index_t *pk)
+{
+    free(pk->col);
+    pk->col = NULL;
+}
+
+int
+pk_solve_query(pk_index_t *pk, int32_t *q, int k, int32_pair_t *rv)
+{
+    uint16_t qq[PK_MAX_LOCI], x[PK_MAX_LOCI];
+    int t, nr;
+
+    pk_query(pk, q, qq, x);
+
+    /* At most k - 1 errors, as in solve_query. */
+    t = pk->m - (k - 1);
+    nr = pk_scan(pk, qq, x, t > 0 ? t : 0, rv);
+
+    fprintf(stderr, "#hits: %d (%d)\n", nr, pk->d);
+    return nr;
+}
+
+int
+pk_solve_nearest(pk_index_t *pk, int32_t *q, int32_pair_t *rv)
+{
+    uint16_t qq[PK_MAX_LOCI], x[PK_MAX_LOCI];
+    int nr;
+
+    pk_query(pk, q, qq, x);
+    nr = pk_scan(pk, qq, x, pk_best(pk, qq, x), rv);
+
+    fprintf(stderr, "#hits: %d (%d)\n", nr, pk->d);
+    return nr;
+}
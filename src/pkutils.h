@@ -0,0 +1,45 @@
+/*-
+ * Copyright (c) 2017, Alexandre P. Francisco <aplf@ist.utl.pt>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PKUTILS_H
+#define PKUTILS_H
+
+#include "sautils.h"
+
+/* Largest number of loci handled by the packed engine. */
+#define PK_MAX_LOCI 16
+
+/* Packed profiles for small schemes. Alleles are stored as 16 bit values,
+ * one column per locus (structure of arrays), with m padded to 8 or 16 so
+ * that a 7-locus profile fits in a single 128 bit key. Columns have stride
+ * entries, d rounded up to a multiple of 8. If mask is set, only loci l with
+ * mask[l] set count as errors.
+ */
+typedef struct {
+    int32_t d, n_al, m, stride;
+    uint16_t *col;
+    uint8_t *mask;
+} pk_index_t;
+
+int pk_build(pk_index_t *pk, int32_t *s, int d, int m);
+int pk_write(pk_index_t *pk, FILE *fptr);
+int32_t *pk_map(pk_index_t *pk, int32_t *p);
+void pk_free(pk_index_t *pk);
+
+int pk_solve_query(pk_index_t *pk, int32_t *q, int k, int32_pair_t *r);
+int pk_solve_nearest(pk_index_t *pk, int32_t *q, int32_pair_t *r);
+
+#endif
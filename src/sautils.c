@@ -19,9 +19,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "sautils.h"
 
+/* Rows prefetched ahead of verification. */
+#define SA_PREFETCH 8
+/* Loci compared at once by masked_distance. */
+#define SA_CHUNK 64
+
 static int
 array_cmp(int32_t *u, int k, int32_t *v, int l)
 {
@@ -34,12 +40,14 @@ array_cmp(int32_t *u, int k, int32_t *v, int l)
 }
 
 static int
-sa_search_low(int *SA, int32_t *s, int n, int32_t *p, int m)
+sa_search_low(int *SA, int32_t *s, int w, int lo, int hi, int32_t *p,
+    int m)
 {
-    int lo = 0, hi = n - 1, mid;
-    while (lo <= hi) {
+    int mid;
+
+    for (hi--; lo <= hi; ) {
         mid = lo + (hi - lo) / 2;
-        int cmp = array_cmp(p, m, s + SA[mid], m);
+        int cmp = array_cmp(p, m, s + SA[mid]*w, m);
         if (cmp <= 0) hi = mid - 1;
         else lo = mid + 1;
     }
@@ -47,12 +55,14 @@ sa_search_low(int *SA, int32_t *s, int n, int32_t *p, int m)
 }
 
 static int
-sa_search_high(int *SA, int32_t *s, int n, int32_t *p, int m)
+sa_search_high(int *SA, int32_t *s, int w, int lo, int hi, int32_t *p,
+    int m)
 {
-    int lo = 0, hi = n - 1, mid;
-    while (lo <= hi) {
+    int mid;
+
+    for (hi--; lo <= hi; ) {
         mid = lo + (hi - lo) / 2;
-        int cmp = array_cmp(p, m, s + SA[mid], m);
+        int cmp = array_cmp(p, m, s + SA[mid]*w, m);
         if (cmp < 0) hi = mid - 1;
         else lo = mid + 1;
     }
@@ -72,38 +82,425 @@ hamming_distance(int32_t *s, int32_t *r, int m, int k, int p)
     return x;
 }
 
-int
-solve_query(int32_t *s, int32_t *sa, int32_t *q, int d, int m, int k,
-    int32_pair_t *rv)
+/* Distance over the nr runs of loci [run[2i], run[2i+1]). It only stops,
+ * once at least k, between chunks of loci, so that each chunk vectorizes. */
+static int
+masked_distance(int32_t *s, int32_t *r, int32_t *run, int nr, int k)
+{
+    int x = 0, j, l, i, e;
+
+    for (j = 0; j < nr && x < k; j++)
+        for (l = run[2*j]; l < run[2*j+1] && x < k; l = e) {
+            e = l + SA_CHUNK < run[2*j+1] ? l + SA_CHUNK : run[2*j+1];
+            for (i = l; i < e; i++)
+                x += s[i] != r[i];
+        }
+    return x;
+}
+
+/* Splits the loci into runs of consecutive loci in the mask, or a single run
+ * without mask, storing them in the index. */
+static void
+sa_runs(sa_index_t *ix)
+{
+    int m = ix->m, l, r;
+
+    ix->run = malloc(sizeof(int32_t)*(m + 1));
+    for (ix->nrun = l = 0; l < m; l = r + 1) {
+        for (; l < m && ix->mask != NULL && !ix->mask[l]; l++);
+        for (r = l; r < m && (ix->mask == NULL || ix->mask[r]); r++);
+        if (r > l) {
+            ix->run[2*ix->nrun] = l;
+            ix->run[2*ix->nrun+1] = r;
+            ix->nrun ++;
+        }
+    }
+}
+
+/* Lays out the blocks for at most k - 1 errors, storing their starts in ik
+ * and returning how many, all of length *b. Without a mask these are the m/k
+ * long blocks. With a mask, blocks lie within runs of loci in the mask and
+ * are as long as possible while there are at least k of them. No blocks are
+ * returned if there cannot be k, and then every ST is a candidate.
+ */
+static int
+sa_blocks(sa_index_t *ix, int k, int *ik, int *b)
+{
+    int m = ix->m, j, l, nb, nw;
+
+    if (ix->mask == NULL) {
+        *b = m/k;
+        if (*b == 0)
+            return 0;
+        for (nb = 0, l = 0; l < m+1 - *b; nb++, l += *b)
+            ik[nb] = l;
+        return nb;
+    }
+
+    if (ix->run == NULL)
+        sa_runs(ix);
+    for (nw = j = 0; j < ix->nrun; j++)
+        nw += ix->run[2*j+1] - ix->run[2*j];
+
+    for (*b = nw/k; *b > 0; (*b)--) {
+        for (nb = j = 0; j < ix->nrun; j++)
+            nb += (ix->run[2*j+1] - ix->run[2*j]) / *b;
+        if (nb >= k)
+            break;
+    }
+    if (*b == 0)
+        return 0;
+
+    for (nb = j = 0; j < ix->nrun; j++)
+        for (l = ix->run[2*j]; l + *b <= ix->run[2*j+1]; l += *b)
+            ik[nb++] = l;
+    return nb;
+}
+
+/* Finds the range of suffixes starting with p, using the sampled top levels
+ * when available. With the locus partitioned suffix array, only suffixes
+ * starting at locus ik are searched and the range is within its partition.
+ */
+static void
+sa_search(sa_index_t *ix, int32_t *p, int m, int ik, int *r, int *t)
 {
-    int j, ltk, nv;
+    int n = ix->d*(ix->m+1), lo, hi;
 
-    int *filter = malloc(sizeof(int)*d);
-    memset(filter, 0xff, sizeof(int)*d);
+    if (ix->lsa != NULL) {
+        int32_t *L = ix->lsa + (size_t)ik*ix->d;
+        *r = sa_search_low(L, ix->s + ik, ix->m+1, 0, ix->d, p, m);
+        *t = sa_search_high(L, ix->s + ik, ix->m+1, 0, ix->d, p, m);
+        return;
+    }
+
+    if (ix->ey == NULL) {
+        *r = sa_search_low(ix->sa, ix->s, 1, 0, n, p, m);
+        *t = sa_search_high(ix->sa, ix->s, 1, 0, n, p, m);
+        return;
+    }
+
+    ey_range(ix->ey, ix->s, p, m, 0, &lo, &hi);
+    *r = sa_search_low(ix->sa, ix->s, 1, lo, hi, p, m);
+    ey_range(ix->ey, ix->s, p, m, 1, &lo, &hi);
+    *t = sa_search_high(ix->sa, ix->s, 1, lo, hi, p, m);
+}
+
+static int
+int32_pair_id_cmp(const void *p, const void *q)
+{
+    return ((int32_pair_t *) p)->id - ((int32_pair_t *) q)->id;
+}
+
+/* Marks ST j as seen by the current query, returning whether it was seen. */
+static inline int
+sa_seen(sa_index_t *ix, int j)
+{
+    if (ix->seen[j] == ix->epoch)
+        return 1;
+    ix->seen[j] = ix->epoch;
+    return 0;
+}
+
+/* Answers the query given its nb blocks of length b, starting at ik, and
+ * their suffix array ranges lo and hi. */
+static int
+solve_blocks(sa_index_t *ix, int32_t *q, int k, int nb, int b, int *ik,
+    int *lo, int *hi, int32_pair_t *rv)
+{
+    int32_t *s = ix->s, *sa = ix->sa;
+    int d = ix->d, m = ix->m;
+    int ib, i, j, x, ltk, nv, ns = 0;
+    int32_pair_t *c;
+    double recall = 1;
 
-    ltk = nv = 0;
-    for (int ik = 0; ik < m+1 - m/k; ik += m/k) {
-        int r = sa_search_low(sa, s, d*(m+1), q + ik, m/k);
-        int t = sa_search_high(sa, s, d*(m+1), q + ik, m/k);
+    /* Buffers are kept across queries, with seen STs stamped by epoch. */
+    if (ix->seen == NULL) {
+        ix->seen = calloc(d, sizeof(uint32_t));
+        ix->cand = malloc(sizeof(int32_pair_t)*d);
+        ix->epoch = 0;
+    }
+    if (++ix->epoch == 0) {
+        memset(ix->seen, 0, sizeof(uint32_t)*d);
+        ix->epoch = 1;
+    }
+    c = ix->cand;
+    if (ix->run == NULL)
+        sa_runs(ix);
+
+    if (ix->sk != NULL)
+        recall = sk_prepare(ix->sk, q, k);
+
+    /* Collect candidates, with the block they matched. */
+    nv = 0;
+    for (ib = 0; ib < nb; ib++) {
+        int r = lo[ib];
+        int t = hi[ib];
+        if (ix->lsa != NULL) {
+            int32_t *L = ix->lsa + (size_t)ik[ib]*d;
+            for(; r < t && nv < d; r++)
+                if (!sa_seen(ix, L[r])) {
+                    c[nv].id = L[r];
+                    c[nv].n = ik[ib];
+                    nv ++;
+                }
+            continue;
+        }
         for(; r < t && nv < d; r++) {
             j = sa[r]/(m+1);
-            if (sa[r]%(m+1) == ik && filter[j] != 1) {
-                filter[j] = 1;
+            if (sa[r]%(m+1) == ik[ib] && !sa_seen(ix, j)) {
+                c[nv].id = j;
+                c[nv].n = ik[ib];
                 nv ++;
-                int x = hamming_distance(q, s + j*(m+1), m, k, ik);
-                if (x < k) {
-                    rv[ltk].id = j;
-                    rv[ltk].n = x;
-                    ltk++;
-                }
             }
         }
     }
-    free(filter);
+
+    /* Without blocks every ST is a candidate. */
+    if (nb == 0)
+        for (nv = 0; nv < d; nv++) {
+            c[nv].id = nv;
+            c[nv].n = 0;
+        }
+
+    /* Verify them in address order, prefetching the rows ahead. */
+    qsort(c, nv, sizeof(int32_pair_t), int32_pair_id_cmp);
+    for (ltk = i = 0; i < nv; i++) {
+        if (i + SA_PREFETCH < nv)
+            __builtin_prefetch(s + c[i + SA_PREFETCH].id*(m+1) +
+                c[i + SA_PREFETCH].n + b);
+        j = c[i].id;
+        /* Far away according to the sketches. */
+        if (ix->sk != NULL && sk_bound(ix->sk, j) > ix->sk->t) {
+            ns ++;
+            continue;
+        }
+        if (ix->mask != NULL || nb == 0)
+            x = masked_distance(q, s + j*(m+1), ix->run, ix->nrun, k);
+        else
+            x = hamming_distance(q, s + j*(m+1), m, k, c[i].n);
+        if (x < k) {
+            rv[ltk].id = j;
+            rv[ltk].n = x;
+            ltk++;
+        }
+    }
     fprintf(stderr, "#hits: %d (%d)\n", ltk, nv);
+    if (ix->sk != NULL)
+        fprintf(stderr, "#sketch: %d discarded, recall %f\n", ns, recall);
     return ltk;
 }
 
+int
+solve_query(sa_index_t *ix, int32_t *q, int k, int32_pair_t *rv)
+{
+    int m = ix->m, b, nb, ib, nr;
+    clock_t tm;
+
+    int *ik = malloc(sizeof(int)*m);
+    int *lo = malloc(sizeof(int)*m);
+    int *hi = malloc(sizeof(int)*m);
+
+    /* Search all blocks first. */
+    tm = clock();
+    nb = sa_blocks(ix, k, ik, &b);
+    for (ib = 0; ib < nb; ib++)
+        sa_search(ix, q + ik[ib], b, ik[ib], lo + ib, hi + ib);
+    tm = clock() - tm;
+
+    nr = solve_blocks(ix, q, k, nb, b, ik, lo, hi, rv);
+
+    free(hi);
+    free(lo);
+    free(ik);
+    fprintf(stderr, "#search: %d blocks, %f ms\n", nb,
+        1e3*tm/CLOCKS_PER_SEC);
+    return nr;
+}
+
+/* A block of a query in a batch: the pattern, the partition where it is
+ * searched, and its entry in the batch, or its range once resolved. */
+typedef struct {
+    int32_t *p;
+    int part, id, lo, hi;
+} sa_pattern_t;
+
+/* Block length, for comparing patterns with qsort. */
+static int sa_pattern_len;
+
+static int
+sa_pattern_cmp(const void *p, const void *q)
+{
+    sa_pattern_t * ip = (sa_pattern_t *) p;
+    sa_pattern_t * iq = (sa_pattern_t *) q;
+
+    if (ip->part != iq->part)
+        return ip->part - iq->part;
+
+    return array_cmp(ip->p, sa_pattern_len, iq->p, sa_pattern_len);
+}
+
+/* Resolves the sorted and distinct patterns u[i..j), all within [lo, hi).
+ * Patterns before the middle one lie before its range, those after it lie
+ * after, thus each half is searched only within what is left. */
+static void
+sa_search_batch(int32_t *SA, int32_t *s, int w, sa_pattern_t *u, int i,
+    int j, int lo, int hi, int m)
+{
+    int mid;
+
+    if (i >= j)
+        return;
+
+    mid = i + (j - i) / 2;
+    u[mid].lo = sa_search_low(SA, s, w, lo, hi, u[mid].p, m);
+    u[mid].hi = sa_search_high(SA, s, w, u[mid].lo, hi, u[mid].p, m);
+
+    sa_search_batch(SA, s, w, u, i, mid, lo, u[mid].lo, m);
+    sa_search_batch(SA, s, w, u, mid + 1, j, u[mid].hi, hi, m);
+}
+
+int
+solve_batch(sa_index_t *ix, int32_t *q, int nq, int k, int32_pair_t **rv,
+    int *off)
+{
+    int d = ix->d, m = ix->m, n = d*(m+1), b, nb, np;
+    int i, j, ib, nu;
+    clock_t tm;
+
+    int *ik = malloc(sizeof(int)*m);
+    nb = sa_blocks(ix, k, ik, &b);
+    np = nq*nb;
+    sa_pattern_t *u = malloc(sizeof(sa_pattern_t)*np);
+    int *map = malloc(sizeof(int)*np);
+    int *lo = malloc(sizeof(int)*np);
+    int *hi = malloc(sizeof(int)*np);
+    int32_pair_t *r = malloc(sizeof(int32_pair_t)*d);
+
+    tm = clock();
+
+    /* All blocks of all queries, sorted. The locus partitioned suffix array
+     * has one partition per locus, otherwise all blocks share the same. */
+    for (i = 0; i < nq; i++)
+        for (ib = 0; ib < nb; ib++) {
+            u[i*nb + ib].p = q + (size_t)i*(m+1) + ik[ib];
+            u[i*nb + ib].part = ix->lsa != NULL ? ik[ib] : 0;
+            u[i*nb + ib].id = i*nb + ib;
+        }
+    sa_pattern_len = b;
+    qsort(u, np, sizeof(sa_pattern_t), sa_pattern_cmp);
+
+    /* Drop repeated patterns, remembering where each block went. */
+    for (nu = i = 0; i < np; i++) {
+        if (nu == 0 || sa_pattern_cmp(u + nu - 1, u + i) != 0)
+            u[nu++] = u[i];
+        map[u[i].id] = nu - 1;
+    }
+
+    /* Resolve each partition in one descent. */
+    for (i = 0; i < nu; i = j) {
+        for (j = i; j < nu && u[j].part == u[i].part; j++);
+        if (ix->lsa != NULL)
+            sa_search_batch(ix->lsa + (size_t)u[i].part*d, ix->s + u[i].part,
+                m+1, u, i, j, 0, d, b);
+        else
+            sa_search_batch(ix->sa, ix->s, 1, u, i, j, 0, n, b);
+    }
+
+    for (i = 0; i < np; i++) {
+        lo[i] = u[map[i]].lo;
+        hi[i] = u[map[i]].hi;
+    }
+
+    tm = clock() - tm;
+    fprintf(stderr, "#batch: %d queries, %d blocks, %d distinct, %f ms\n",
+        nq, np, nu, 1e3*tm/CLOCKS_PER_SEC);
+
+    /* Answer each query, appending its matches. */
+    *rv = NULL;
+    for (off[0] = i = 0; i < nq; i++) {
+        j = solve_blocks(ix, q + (size_t)i*(m+1), k, nb, b, ik, lo + i*nb,
+            hi + i*nb, r);
+        *rv = realloc(*rv, sizeof(int32_pair_t)*(off[i] + j + 1));
+        memcpy(*rv + off[i], r, sizeof(int32_pair_t)*j);
+        off[i+1] = off[i] + j;
+    }
+
+    free(r);
+    free(hi);
+    free(lo);
+    free(map);
+    free(u);
+    free(ik);
+    return off[nq];
+}
+
+void
+sa_partition(int32_t *sa, int32_t *lsa, int d, int m)
+{
+    int32_t *c = calloc(m + 1, sizeof(int32_t));
+    int r, l, n = d*(m+1);
+
+    /* Suffix sa[0] is the empty one, the others are split by starting locus,
+     * dropping those starting at separators. Each partition stays sorted. */
+    for (r = 1; r <= n; r++) {
+        l = sa[r]%(m+1);
+        if (l < m)
+            lsa[(size_t)l*d + c[l]++] = sa[r]/(m+1);
+    }
+
+    free(c);
+}
+
+void
+solve_free(sa_index_t *ix)
+{
+    free(ix->seen);
+    free(ix->cand);
+    free(ix->run);
+    ix->seen = NULL;
+    ix->cand = NULL;
+    ix->run = NULL;
+}
+
+int
+solve_nearest(sa_index_t *ix, int32_t *q, int32_pair_t *rv)
+{
+    int d = ix->d, m = ix->m, j, k, nr, x;
+
+    /* Only loci in the mask count. */
+    if (ix->mask != NULL)
+        for (m = j = 0; j < ix->m; j++)
+            m += ix->mask[j];
+
+    /* Double the number of blocks until something is found. With m blocks
+     * every ST sharing at least one allele with the query is found. */
+    for (k = 1; ; k <<= 1) {
+        if (k > m)
+            k = m;
+        nr = solve_query(ix, q, k, rv);
+        if (nr > 0 || k == m)
+            break;
+    }
+
+    /* Nothing in common, all STs are at distance m. */
+    if (nr == 0) {
+        for (j = 0; j < d; j++) {
+            rv[j].id = j;
+            rv[j].n = m;
+        }
+        return d;
+    }
+
+    for (x = m, j = 0; j < nr; j++)
+        if (rv[j].n < x)
+            x = rv[j].n;
+    for (k = j = 0; j < nr; j++)
+        if (rv[j].n == x)
+            rv[k++] = rv[j];
+
+    return k;
+}
+
 int
 int32_pair_cmp(const void *p, const void *q)
 {
@@ -17,14 +17,40 @@
 #ifndef SAUTILS_H
 #define SAUTILS_H
 
+#include "skutils.h"
+#include "eyutils.h"
+
 typedef struct {
     int32_t id, n;
 } int32_pair_t;
 
+/* The text s, the profiles of d STs with m loci each followed by a zero, and
+ * its suffix array, together with the optional sections in use and buffers
+ * reused across queries (zero them before the first query). Instead of sa,
+ * the index may have lsa, the locus partitioned suffix array: m partitions
+ * of d entries, partition l listing STs sorted by their suffix at locus l.
+ * If mask is set, only loci l with mask[l] set count as errors. The nrun
+ * runs of consecutive loci that count are kept in run, as [start, end) pairs.
+ */
+typedef struct {
+    int32_t *s, *sa, *lsa;
+    int32_t d, m;
+    sk_index_t *sk;
+    ey_index_t *ey;
+    uint8_t *mask;
+    int32_t *run, nrun;
+    uint32_t *seen, epoch;
+    int32_pair_t *cand;
+} sa_index_t;
+
 void suffixsort(int *x, int *p, int n, int k, int l);
+void sa_partition(int32_t *sa, int32_t *lsa, int d, int m);
 
-int solve_query(int32_t *s, int32_t *sa, int32_t *q, int d, int m, int k,
-    int32_pair_t *r);
+int solve_query(sa_index_t *ix, int32_t *q, int k, int32_pair_t *r);
+int solve_nearest(sa_index_t *ix, int32_t *q, int32_pair_t *r);
+int solve_batch(sa_index_t *ix, int32_t *q, int nq, int k, int32_pair_t **r,
+    int *off);
+void solve_free(sa_index_t *ix);
 
 int int32_pair_cmp(const void *p, const void *q);
 
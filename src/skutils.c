@@ -0,0 +1,147 @@
+/*-
+ * Copyright (c) 2017, Alexandre P. Francisco <aplf@ist.utl.pt>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Bit sketches for discarding far away candidates before verification. For
+ * large thresholds the pigeonhole blocks are short and most STs pass the
+ * suffix array filter, but most of them are far from the query.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "skutils.h"
+
+/* One hash bit for the pair (l, a), from the splitmix64 finalizer. */
+static uint32_t
+sk_hash(int l, int32_t a)
+{
+    uint64_t z = ((uint64_t)(uint32_t)l << 32) | (uint32_t)a;
+
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+
+    return z >> 63;
+}
+
+static void
+sk_sketch(int g, int32_t *p, int m, uint32_t *u)
+{
+    int l;
+
+    memset(u, 0, sizeof(uint32_t)*(g/32));
+    for (l = 0; l < m; l++)
+        u[(l%g)/32] ^= sk_hash(l, p[l]) << ((l%g)%32);
+}
+
+/* Binomial(n, 1/2) probability mass at i. */
+static double
+sk_pmf(int n, int i)
+{
+    if (i > n)
+        return 0;
+    return exp(lgamma(n + 1) - lgamma(i + 1) - lgamma(n - i + 1) - n*log(2));
+}
+
+int
+sk_build(sk_index_t *sk, int32_t *s, int d, int m)
+{
+    int j;
+
+    if (m < SK_MIN_LOCI)
+        return -1;
+
+    /* Use as many groups as possible, a power of two, up to one per locus. */
+    for (sk->g = SK_MAX_BITS; sk->g > m; sk->g >>= 1);
+
+    sk->d = d;
+    sk->m = m;
+    sk->w = sk->g/32;
+    sk->sig = malloc(sizeof(uint32_t)*(size_t)d*sk->w);
+    if (sk->sig == NULL)
+        return -1;
+
+    for (j = 0; j < d; j++)
+        sk_sketch(sk->g, s + (size_t)j*(m+1), m, sk->sig + (size_t)j*sk->w);
+
+    return 0;
+}
+
+int
+sk_write(sk_index_t *sk, FILE *fptr)
+{
+    int wn;
+    size_t sz = (size_t)sk->d*sk->w;
+
+    wn = fwrite(&sk->d, sizeof(int32_t), 1, fptr);
+    wn += fwrite(&sk->m, sizeof(int32_t), 1, fptr);
+    wn += fwrite(&sk->g, sizeof(int32_t), 1, fptr);
+    wn += fwrite(&sk->w, sizeof(int32_t), 1, fptr);
+    if (wn != 4 || fwrite(sk->sig, sizeof(uint32_t), sz, fptr) != sz)
+        return -1;
+
+    return 0;
+}
+
+int32_t *
+sk_map(sk_index_t *sk, int32_t *p)
+{
+    sk->d = p[0];
+    sk->m = p[1];
+    sk->g = p[2];
+    sk->w = p[3];
+    sk->sig = (uint32_t *)(p + 4);
+    sk->recall = 1;
+
+    return p + 4 + (size_t)sk->d*sk->w;
+}
+
+void
+sk_free(sk_index_t *sk)
+{
+    free(sk->sig);
+    sk->sig = NULL;
+}
+
+/* Sketches the query and sets the cutoff for at most k - 1 errors. In exact
+ * mode, recall 1, only STs whose bound exceeds k - 1 are discarded. In
+ * approximate mode an ST at distance k - 1 differs in at most k - 1 groups,
+ * each flipping its bit with probability 1/2, and the cutoff is the smallest
+ * one keeping such an ST with the requested probability. Returns this
+ * probability, a lower bound on the expected recall.
+ */
+double
+sk_prepare(sk_index_t *sk, int32_t *q, int k)
+{
+    int n = k - 1 < sk->g ? k - 1 : sk->g;
+    double x;
+
+    sk_sketch(sk->g, q, sk->m, sk->qs);
+
+    sk->t = k - 1;
+    if (sk->recall >= 1)
+        return 1;
+
+    x = sk_pmf(n, 0);
+    for (sk->t = 0; sk->t < k - 1 && x < sk->recall; sk->t++)
+        x += sk_pmf(n, sk->t + 1);
+
+    return x < 1 ? x : 1;
+}
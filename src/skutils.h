@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2017, Alexandre P. Francisco <aplf@ist.utl.pt>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SKUTILS_H
+#define SKUTILS_H
+
+/* Smallest number of loci for which sketches are built. */
+#define SK_MIN_LOCI 64
+/* Largest sketch, in bits. */
+#define SK_MAX_BITS 1024
+
+/* Bit sketches of the profiles. Loci are split into g groups, locus l in
+ * group l%g, and bit i of a sketch is the parity of hash bits of the
+ * (locus, allele) pairs in group i. Sketches take w words each.
+ */
+typedef struct {
+    int32_t d, m, g, w;
+    uint32_t *sig;
+    /* Query state, see sk_prepare. */
+    double recall;
+    int t;
+    uint32_t qs[SK_MAX_BITS/32];
+} sk_index_t;
+
+int sk_build(sk_index_t *sk, int32_t *s, int d, int m);
+int sk_write(sk_index_t *sk, FILE *fptr);
+int32_t *sk_map(sk_index_t *sk, int32_t *p);
+void sk_free(sk_index_t *sk);
+
+double sk_prepare(sk_index_t *sk, int32_t *q, int k);
+
+/* Lower bound on the distance between the query and ST j. Each differing
+ * bit implies that at least one locus in that group differs. */
+static inline int
+sk_bound(sk_index_t *sk, int j)
+{
+    uint32_t *u = sk->sig + (size_t)j*sk->w;
+    int i, x = 0;
+
+    for (i = 0; i < sk->w; i++)
+        x += __builtin_popcount(u[i] ^ sk->qs[i]);
+
+    return x;
+}
+
+#endif